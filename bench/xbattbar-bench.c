@@ -0,0 +1,205 @@
+/*
+ * xbattbar-bench: probes used by "make bench"
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ *   xbattbar-bench sample <runs> <checker>
+ *	run a checker <runs> times, print wall and CPU time per sample
+ *   xbattbar-bench metrics <socket>
+ *	print the counters served by "xbattbar --metrics <socket>"
+ *   xbattbar-bench latency <file> <value> <x> <y> <timeout-ms>
+ *	write <value> into <file> and wait until the root window pixel
+ *	at <x>,<y> changes; print the elapsed time
+ *
+ * Every result is printed as a single JSON object on stdout.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+
+static long long now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static long long tv_us(struct timeval *tv)
+{
+  return (long long)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+  long long x = *(const long long *)a, y = *(const long long *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+/*
+ * run_checker:
+ * one sample exactly the way xbattbar takes it: fork, exec, read the
+ * pipe, wait
+ */
+static int run_checker(char *checker)
+{
+  char buf[4096];
+  int p[2], pid, status;
+  char *argv[] = { checker, NULL };
+
+  if (pipe(p) != 0)
+    return -1;
+  if ((pid = fork()) == -1)
+    return -1;
+  if (pid == 0) {
+    close(p[0]);
+    dup2(p[1], 1);
+    execvp(checker, argv);
+    _exit(127);
+  }
+  close(p[1]);
+  while (read(p[0], buf, sizeof(buf)) > 0)
+    ;
+  close(p[0]);
+  if (waitpid(pid, &status, 0) == -1)
+    return -1;
+  return status;
+}
+
+static int bench_sample(int runs, char *checker)
+{
+  long long *wall, t0, cpu0, cpu1, sum = 0;
+  struct rusage ru;
+  int i, failures = 0;
+
+  if (runs <= 0 || (wall = calloc(runs, sizeof(*wall))) == NULL)
+    return 1;
+
+  getrusage(RUSAGE_CHILDREN, &ru);
+  cpu0 = tv_us(&ru.ru_utime) + tv_us(&ru.ru_stime);
+  for (i = 0; i < runs; i++) {
+    t0 = now_us();
+    if (run_checker(checker) != 0)
+      failures++;
+    wall[i] = now_us() - t0;
+    sum += wall[i];
+  }
+  getrusage(RUSAGE_CHILDREN, &ru);
+  cpu1 = tv_us(&ru.ru_utime) + tv_us(&ru.ru_stime);
+
+  qsort(wall, runs, sizeof(*wall), cmp_ll);
+  printf("{\"runs\":%d,\"failures\":%d,"
+         "\"wall_us_mean\":%lld,\"wall_us_p50\":%lld,"
+         "\"wall_us_p95\":%lld,\"wall_us_max\":%lld,"
+         "\"cpu_us_mean\":%lld}\n",
+         runs, failures, sum / runs, wall[runs / 2],
+         wall[runs * 95 / 100], wall[runs - 1], (cpu1 - cpu0) / runs);
+  free(wall);
+  return failures == runs;
+}
+
+static int bench_metrics(char *path)
+{
+  struct sockaddr_un sun;
+  char buf[4096];
+  int fd, n;
+
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+      connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+    fprintf(stderr, "xbattbar-bench: %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  while ((n = read(fd, buf, sizeof(buf))) > 0)
+    fwrite(buf, 1, n, stdout);
+  close(fd);
+  return 0;
+}
+
+static unsigned long get_pixel(Display *disp, int x, int y)
+{
+  XImage *img;
+  unsigned long pixel;
+
+  img = XGetImage(disp, DefaultRootWindow(disp), x, y, 1, 1,
+                  AllPlanes, ZPixmap);
+  pixel = XGetPixel(img, 0, 0);
+  XDestroyImage(img);
+  return pixel;
+}
+
+static int bench_latency(char *file, char *value, int x, int y, int timeout)
+{
+  Display *disp;
+  unsigned long before;
+  long long t0, t;
+  char tmp[1024];
+  int fd;
+
+  if ((disp = XOpenDisplay(NULL)) == NULL) {
+    fprintf(stderr, "xbattbar-bench: can't open display\n");
+    return 1;
+  }
+  before = get_pixel(disp, x, y);
+
+  /* replace the file whole, the checker must never read it half written */
+  snprintf(tmp, sizeof(tmp), "%s.new", file);
+  if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1 ||
+      write(fd, value, strlen(value)) != (ssize_t)strlen(value) ||
+      close(fd) == -1 || rename(tmp, file) == -1) {
+    fprintf(stderr, "xbattbar-bench: %s: %s\n", file, strerror(errno));
+    return 1;
+  }
+
+  t0 = now_us();
+  do {
+    usleep(1000);
+    t = now_us() - t0;
+    if (get_pixel(disp, x, y) != before) {
+      printf("{\"latency_us\":%lld}\n", t);
+      XCloseDisplay(disp);
+      return 0;
+    }
+  } while (t < timeout * 1000LL);
+
+  printf("{\"latency_us\":null}\n");
+  XCloseDisplay(disp);
+  return 1;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc == 4 && strcmp(argv[1], "sample") == 0)
+    return bench_sample(atoi(argv[2]), argv[3]);
+  if (argc == 3 && strcmp(argv[1], "metrics") == 0)
+    return bench_metrics(argv[2]);
+  if (argc == 7 && strcmp(argv[1], "latency") == 0)
+    return bench_latency(argv[2], argv[3], atoi(argv[4]), atoi(argv[5]),
+                         atoi(argv[6]));
+
+  fprintf(stderr,
+          "usage:\t%s sample runs checker\n"
+          "\t%s metrics socket\n"
+          "\t%s latency file value x y timeout-ms\n",
+          argv[0], argv[0], argv[0]);
+  return 2;
+}
@@ -41,6 +41,19 @@ static char *ReleaseVersion="1.4.2";
 #include <unistd.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <math.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <limits.h>
+#ifdef __linux__
+#include <linux/netlink.h>
+#include <sys/inotify.h>
+#endif
 
 #define PollingInterval 10	/* APM polling interval in sec */
 #define BI_THICKNESS    3	/* battery indicator thickness in pixels */
@@ -57,6 +70,38 @@ static char *ReleaseVersion="1.4.2";
 #define DiagXMergin 20
 #define DiagYMergin 5
 
+#define OPT_HEADLESS	0x100	/* long-only option codes */
+#define OPT_METRICS	0x101
+#define OPT_RECORD	0x102
+#define OPT_REPLAY	0x103
+#define OPT_SPEED	0x104
+#define OPT_ACTION	0x105
+#define OPT_HYSTERESIS	0x106
+#define OPT_DEBOUNCE	0x107
+
+#define MaxActions	8	/* --action thresholds */
+#define MaxMeters	8	/* --meter bars */
+#define OPT_METER	0x108
+#define OPT_SPARKLINE	0x109
+#define OPT_SEGMENTED	0x10a
+#define OPT_CONFIG	0x10b
+#define OPT_ANIMATE	0x10c
+
+#define AnimMaxFps	60	/* upper bound of --animate */
+#define AnimSlider	16	/* length of the charging highlight, pixels */
+#define AnimSweepMs	2000	/* highlight crosses the charged part in this */
+#define AnimPulseMs	500	/* half period of the critical level pulse */
+
+#define MaxBatteries	4	/* packs shown by --segmented */
+
+#define SparkMinThick	16	/* thinnest bar that can hold a sparkline */
+#define SparkMaxWatts	40	/* default top of the power_now sparkline */
+
+#define HistBuckets	20	/* log2 latency buckets, 1us .. 0.5s */
+
+/* descriptors watched by the main loop; unused slots hold -1 */
+enum { PFD_X, PFD_SIGNAL, PFD_METRICS, PFD_UEVENT, PFD_CONFIG, PFD_MAX };
+
 /*
  * Global variables
  */
@@ -67,7 +112,77 @@ int battery_level = -1;         /* battery level */
 unsigned long onin, onout;      /* indicator colors for AC online */
 unsigned long offin, offout;    /* indicator colors for AC offline */
 
-int elapsed_time = 0;           /* for battery remaining estimation */
+long long sample_time;          /* wall clock ms of the current sample */
+int remain_sec = -1;            /* estimated seconds left, -1 if unknown */
+int remain_charging = False;    /* remain_sec counts up to full charge */
+
+/* optional checker values, -1 if the checker doesn't report them */
+long long energy_now = -1;          /* uWh */
+long long energy_full = -1;         /* uWh, last full charge */
+long long energy_full_design = -1;  /* uWh, as designed */
+long long power_now = -1;           /* uW */
+
+/* per battery values (batteryN=, statusN=, energy_fullN=) */
+struct pack {
+  int level;
+  int discharging;
+  int charging;                 /* status is Charging, -1 if no status */
+  long long full;               /* uWh, -1 if unknown */
+} packs[MaxBatteries];
+int npacks = 0;
+int segmented = False;          /* one bar segment per battery */
+
+/*
+ * config file: "key = value" lines for the settings below.  Settings
+ * given on the command line win; a key removed from the file goes back
+ * to its default.
+ */
+enum { S_ONIN, S_ONOUT, S_OFFIN, S_OFFOUT, S_CHECKER,
+       S_THICKNESS, S_INTERVAL, S_POSITION, S_ONTOP, S_MAX };
+
+struct setting {
+  char *name;
+  char **str;                   /* string setting, or */
+  int *num;                     /* numeric setting */
+  int from_cli;                 /* set on the command line */
+  char *def_str;                /* value before the config file */
+  int def_num;
+  char value[PATH_MAX];         /* config file value, *str points here */
+};
+
+extern struct setting settings[S_MAX];
+
+/*
+ * animation: a highlight running along the bar while charging and a
+ * pulse below the critical level.  Frames only repaint the animated
+ * part of the window from a back buffer holding the still bar, and no
+ * frames are scheduled when there is nothing to animate or the bar
+ * can't be seen.
+ */
+enum { ANIM_NONE, ANIM_CHARGE, ANIM_PULSE };
+int anim_fps = 0;                   /* frame cap, 0: no animation */
+Pixmap anim_pix;                    /* back buffer */
+int bar_obscured = False;           /* winbar is VisibilityFullyObscured */
+long long next_frame;               /* monotonic ms of the next frame */
+struct {
+  int a, len;                   /* highlight drawn on the window */
+  int phase;                    /* pulse: 1 while the fill is hidden */
+} anim;
+char config_path[PATH_MAX];
+
+/*
+ * battery health: running values only, updated once per sample
+ */
+struct {
+  double capacity;              /* energy_full/energy_full_design in %, <0 unknown */
+  double cycles;                /* equivalent full discharge cycles */
+  unsigned long n;              /* discharge rate samples */
+  double rate_mean, rate_m2;    /* Welford mean and sum of squares, W */
+  double rate_max;
+  long long last_energy;        /* last differing energy_now, -1 if none */
+  long long last_energy_time;   /* sample_time when last_energy was taken */
+  int last_level;
+} health = { -1, 0, 0, 0, 0, 0, -1, 0, -1 };
 
 /* indicator default colors */
 char *ONIN_C   = "green";
@@ -80,8 +195,7 @@ char *EXTERNAL_CHECK_ACPI = "/usr/lib/xbattbar/xbattbar-check-acpi";
 char *EXTERNAL_CHECK_SYS = "/usr/lib/xbattbar/xbattbar-check-sys";
 
 int alwaysontop = False;
-
-struct itimerval IntervalTimer;     /* APM polling interval timer */
+int headless = False;           /* no X connection, records on stdout */
 
 int bi_direction = BI_Bottom;       /* status bar location */
 int bi_height;                      /* height of Battery Indicator */
@@ -91,10 +205,97 @@ int bi_y;                           /* y coordinate of upper left corner */
 int bi_thick = BI_THICKNESS;        /* thickness of Battery Indicator */
 int bi_interval = PollingInterval;  /* interval of polling APM */
 
+long long next_sample;              /* monotonic ms of the next poll */
+struct pollfd pfd[PFD_MAX];         /* main loop descriptors */
+int sigpipe[2] = { -1, -1 };        /* self-pipe woken by signal handlers */
+volatile sig_atomic_t dump_requested = 0;
+char *metrics_path = NULL;          /* UNIX socket serving the counters */
+
+FILE *record_fp = NULL;             /* --record: trace being written */
+FILE *replay_fp = NULL;             /* --replay: trace being played */
+double replay_speed = 1.0;          /* trace time scale, 0: no waiting */
+
+/*
+ * critical battery actions: each fires at most once per discharge
+ * cycle and is re-armed on AC line once the level is hysteresis above
+ */
+struct action {
+  int level;                    /* fire at or below this level */
+  char *command;                /* run by /bin/sh -c */
+  int armed;
+  int count;                    /* consecutive samples at or below */
+} actions[MaxActions];
+int nactions = 0;
+int action_hysteresis = 2;          /* re-arm margin in percent */
+int action_debounce = 1;            /* samples needed before firing */
+
+/*
+ * meters: extra edge bars for other values, sampled in the same wakeup
+ * as the battery and drawn on the same X connection
+ */
+enum { METER_FILE, METER_LOADAVG, METER_KEY };
+
+struct meter {
+  int kind;
+  char *arg;                    /* file path or checker key */
+  char key[64];                 /* "name=" looked up for METER_KEY */
+  int fd;                       /* kept open, re-read with pread() */
+  double min, max;              /* value range mapped onto the bar */
+  double value;                 /* last reading, NAN if none */
+  int direction;
+  int follow;                   /* stays on the battery bar's edge */
+  char *in_c, *out_c;           /* color names */
+  unsigned long in, out;
+  int x, y, w, h;
+  Window win;
+  int pos;                      /* drawn fill length, -1: repaint */
+} meters[MaxMeters];
+int nmeters = 0;
+
+/*
+ * sparkline: the battery bar shows a history of power_now or of the
+ * level instead.  The history lives only in a server side pixmap which
+ * is scrolled by one pixel per sample.
+ */
+enum { SPARK_NONE, SPARK_POWER, SPARK_LEVEL };
+int spark_mode = SPARK_NONE;
+double spark_max = SparkMaxWatts;   /* power mapped to full thickness */
+Pixmap spark_pix;
+
+/*
+ * self instrumentation: plain counters, updated only from the main
+ * loop, so no locking and no allocation is needed
+ */
+struct histogram {
+  unsigned long count;
+  unsigned long long sum_us;
+  unsigned long bucket[HistBuckets];  /* bucket[i]: < 2^i us */
+};
+
+struct {
+  unsigned long samples;        /* battery_check() calls */
+  unsigned long sample_errors;  /* samples which gave no battery value */
+  unsigned long parse_errors;   /* checker output not understood */
+  unsigned long redraws;        /* bar repaints */
+  unsigned long x_requests;     /* X requests issued by repaints */
+  unsigned long wakeups;        /* main loop iterations */
+  unsigned long events;         /* X events handled */
+  unsigned long uevents;        /* power_supply uevents received */
+  unsigned long actions;        /* threshold actions started */
+  unsigned long reloads;        /* config file reloads */
+  unsigned long frames;         /* animation frames drawn */
+  struct histogram spawn;       /* fork .. checker output read */
+  struct histogram parse;       /* checker output parsing */
+  struct histogram render;      /* redraw() incl. flush */
+  struct histogram frame;       /* one animation frame */
+} stats;
+
 Display *disp;
 Window winbar;                  /* bar indicator window */
 Window winstat = -1;            /* battery status window */
+Drawable bardraw;               /* winbar, or the animation back buffer */
 GC gcbar;
+GC gccopy;                      /* for XCopyArea: no NoExpose events */
 GC gcstat;
 unsigned int width,height;
 XEvent theEvent;
@@ -104,7 +305,10 @@ XEvent theEvent;
  */
 void InitDisplay(void);
 Status AllocColor(char *, unsigned long *);
-void battery_check(void);
+int battery_check(void);
+int parse_status(char *);
+long long parse_value(char *, char *);
+char *find_key(char *, char *);
 void plug_proc(int);
 void battery_proc(int);
 void redraw(void);
@@ -112,7 +316,52 @@ void showdiagbox(void);
 void disposediagbox(void);
 void usage(char **);
 void about_this_program(void);
-void estimate_remain(void);
+int estimate_remain(void);
+void sample(void);
+void emit_record(void);
+void main_loop(void);
+void handle_event(XEvent *);
+long long now_ms(void);
+long long now_us(void);
+long long cpu_us(void);
+long long wall_ms(void);
+void init_replay(char *);
+int replay_check(void);
+long long replay_next(void);
+void replay_score(void);
+void record_sample(void);
+void analyze_sample(void);
+int format_health(char *, int, int);
+void add_action(char *);
+void check_actions(void);
+void run_action(struct action *);
+void init_uevent(void);
+int read_uevent(void);
+void bar_geometry(int, int, int, int *, int *, int *, int *);
+int parse_direction(char *);
+void add_meter(char *);
+void init_meters(void);
+void sample_meters(void);
+void meters_from_status(char *);
+void draw_meter(struct meter *);
+struct meter *find_meter(Window);
+void set_sparkline(char *);
+void init_sparkline(void);
+void spark_push(void);
+void segmented_proc(void);
+void place_meters(void);
+void config_default_path(void);
+void load_config(void);
+void init_config_watch(void);
+int read_config_watch(void);
+void init_animation(void);
+int anim_effect(void);
+void anim_frame(void);
+void hist_add(struct histogram *, long long);
+void init_signals(void);
+void init_metrics(void);
+void serve_metrics(void);
+void dump_metrics(int, int);
 
 /*
  * usage of this command
@@ -130,7 +379,7 @@ void usage(char **argv)
 {
   fprintf(stderr,
     "\n"
-    "usage:\t%s [-a] [-h|v] [-p sec] [-t thickness]\n"
+    "usage:\t%s [-a] [-h|v] [-p sec] [-t thickness] [--headless]\n"
     "\t\t[-I color] [-O color] [-i color] [-o color]\n"
     "\t\t[ top | bottom | left | right ]\n"
     "-a:         always on top.\n"
@@ -142,7 +391,27 @@ void usage(char **argv)
     "top, bottom, left, right: bar localtion. [def: \"bottom\"]\n"
     "\n"
     "-c:         use ACPI checker for getting battery status\n"
-    "-s script:  use external script for getting battery status\n",
+    "-s script:  use external script for getting battery status\n"
+    "\n"
+    "--headless: don't open a display, print a record on every change\n"
+    "--metrics path: serve internal counters on a UNIX socket\n"
+    "                (also dumped to stderr on SIGUSR1)\n"
+    "--record file:  append every sample to a trace file\n"
+    "--replay file:  take samples from a trace instead of a checker\n"
+    "--speed factor: replay time scale, 0 for no waiting [def: 1]\n"
+    "--action level:command: run command once per discharge cycle when\n"
+    "                the battery level drops to level on AC off-line\n"
+    "--hysteresis n: re-arm actions n%% above their level [def: 2]\n"
+    "--debounce n:   samples at or below level before firing [def: 1]\n"
+    "--meter source,min,max[,edge[,color[,color]]]: extra bar for\n"
+    "                file:path, loadavg or key:name (checker output)\n"
+    "--sparkline power[,watts]|level: draw a history in the bar\n"
+    "                (needs -t 16 or more) [def: 40 watts]\n"
+    "--segmented:    one bar segment per battery\n"
+    "--config file:  settings file, reloaded when it changes\n"
+    "                [def: ~/.config/xbattbar/config]\n"
+    "--animate fps:  animate charging and critical level, at most\n"
+    "                fps frames per second\n",
     argv[0]);
   _exit(0);
 }
@@ -163,6 +432,41 @@ Status AllocColor(char *name, unsigned long *pixel)
   return(status);
 }
 
+/*
+ * bar_geometry:
+ * place a bar of the given thickness along an edge of the screen,
+ * offset pixels away from that edge
+ */
+void bar_geometry(int direction, int offset, int thick,
+                  int *x, int *y, int *w, int *h)
+{
+  switch (direction) {
+  case BI_Top: /* (0,0) - (width, thick) */
+    *w = width;
+    *h = thick;
+    *x = 0;
+    *y = offset;
+    break;
+  case BI_Bottom:
+    *w = width;
+    *h = thick;
+    *x = 0;
+    *y = height - thick - offset;
+    break;
+  case BI_Left:
+    *w = thick;
+    *h = height;
+    *x = offset;
+    *y = 0;
+    break;
+  case BI_Right:
+    *w = thick;
+    *h = height;
+    *x = width - thick - offset;
+    *y = 0;
+  }
+}
+
 /*
  * InitDisplay:
  * create small window in top or bottom
@@ -173,11 +477,14 @@ void InitDisplay(void)
   int x,y;
   unsigned int border,depth;
   XSetWindowAttributes att;
+  XGCValues gcv;
 
   if((disp = XOpenDisplay(NULL)) == NULL) {
       fprintf(stderr, "xbattbar: can't open display.\n");
       _exit(1);
   }
+  /* keep the X connection out of checkers and actions */
+  fcntl(ConnectionNumber(disp), F_SETFD, FD_CLOEXEC);
 
   if(XGetGeometry(disp, DefaultRootWindow(disp), &root, &x, &y,
                  &width, &height, &border, &depth) == 0) {
@@ -193,31 +500,8 @@ void InitDisplay(void)
     _exit(1);
   }
 
-  switch (bi_direction) {
-  case BI_Top: /* (0,0) - (width, bi_thick) */
-    bi_width = width;
-    bi_height = bi_thick;
-    bi_x = 0;
-    bi_y = 0;
-    break;
-  case BI_Bottom:
-    bi_width = width;
-    bi_height = bi_thick;
-    bi_x = 0;
-    bi_y = height - bi_thick;
-    break;
-  case BI_Left:
-    bi_width = bi_thick;
-    bi_height = height;
-    bi_x = 0;
-    bi_y = 0;
-    break;
-  case BI_Right:
-    bi_width = bi_thick;
-    bi_height = height;
-    bi_x = width - bi_thick;
-    bi_y = 0;
-  }
+  bar_geometry(bi_direction, 0, bi_thick,
+               &bi_x, &bi_y, &bi_width, &bi_height);
 
   winbar = XCreateSimpleWindow(disp, DefaultRootWindow(disp),
                               bi_x, bi_y, bi_width, bi_height,
@@ -230,57 +514,151 @@ void InitDisplay(void)
   XMapWindow(disp, winbar);
 
   gcbar = XCreateGC(disp, winbar, 0, 0);
+  gcv.graphics_exposures = False;
+  gccopy = XCreateGC(disp, winbar, GCGraphicsExposures, &gcv);
+  bardraw = winbar;
 }
 
-main(int argc, char **argv)
+int main(int argc, char **argv)
 {
   extern char *optarg;
   extern int optind;
+  static struct option longopts[] = {
+    { "headless", no_argument, NULL, OPT_HEADLESS },
+    { "metrics", required_argument, NULL, OPT_METRICS },
+    { "record", required_argument, NULL, OPT_RECORD },
+    { "replay", required_argument, NULL, OPT_REPLAY },
+    { "speed", required_argument, NULL, OPT_SPEED },
+    { "action", required_argument, NULL, OPT_ACTION },
+    { "hysteresis", required_argument, NULL, OPT_HYSTERESIS },
+    { "debounce", required_argument, NULL, OPT_DEBOUNCE },
+    { "meter", required_argument, NULL, OPT_METER },
+    { "sparkline", required_argument, NULL, OPT_SPARKLINE },
+    { "segmented", no_argument, NULL, OPT_SEGMENTED },
+    { "config", required_argument, NULL, OPT_CONFIG },
+    { "animate", required_argument, NULL, OPT_ANIMATE },
+    { NULL, 0, NULL, 0 }
+  };
+  char *replay_path = NULL;
   int ch;
 
   about_this_program();
-  while ((ch = getopt(argc, argv, "at:f:hI:i:O:o:p:vs:cr")) != -1)
+  while ((ch = getopt_long(argc, argv, "at:f:hI:i:O:o:p:vs:cr",
+                           longopts, NULL)) != -1)
     switch (ch) {
     case 'c':
       EXTERNAL_CHECK = EXTERNAL_CHECK_ACPI;
+      settings[S_CHECKER].from_cli = True;
       break;
 
     case 'r':
       EXTERNAL_CHECK = EXTERNAL_CHECK_SYS;
+      settings[S_CHECKER].from_cli = True;
       break;
 
     case 's':
       EXTERNAL_CHECK = optarg;
+      settings[S_CHECKER].from_cli = True;
       break;
 
     case 'a':
       alwaysontop = True;
+      settings[S_ONTOP].from_cli = True;
       break;
 
     case 't':
     case 'f':
       bi_thick = atoi(optarg);
+      settings[S_THICKNESS].from_cli = True;
       break;
 
     case 'I':
       ONIN_C = optarg;
+      settings[S_ONIN].from_cli = True;
       break;
     case 'i':
       OFFIN_C = optarg;
+      settings[S_OFFIN].from_cli = True;
       break;
     case 'O':
       ONOUT_C = optarg;
+      settings[S_ONOUT].from_cli = True;
       break;
     case 'o':
       OFFOUT_C = optarg;
+      settings[S_OFFOUT].from_cli = True;
       break;
 
     case 'p':
       bi_interval = atoi(optarg);
+      settings[S_INTERVAL].from_cli = True;
+      break;
+
+    case OPT_HEADLESS:
+      headless = True;
+      break;
+
+    case OPT_METRICS:
+      metrics_path = optarg;
+      break;
+
+    case OPT_RECORD:
+      if ((record_fp = fopen(optarg, "a")) == NULL) {
+        fprintf(stderr, "xbattbar: %s: %s\n", optarg, strerror(errno));
+        _exit(1);
+      }
+      setvbuf(record_fp, NULL, _IOLBF, 0);
+      break;
+
+    case OPT_REPLAY:
+      replay_path = optarg;
+      break;
+
+    case OPT_SPEED:
+      replay_speed = atof(optarg);
+      break;
+
+    case OPT_ACTION:
+      add_action(optarg);
+      break;
+
+    case OPT_HYSTERESIS:
+      action_hysteresis = atoi(optarg);
+      break;
+
+    case OPT_DEBOUNCE:
+      action_debounce = atoi(optarg);
+      break;
+
+    case OPT_METER:
+      add_meter(optarg);
+      break;
+
+    case OPT_SPARKLINE:
+      set_sparkline(optarg);
+      break;
+
+    case OPT_SEGMENTED:
+      segmented = True;
+      break;
+
+    case OPT_CONFIG:
+      if (strlen(optarg) >= sizeof(config_path)) {
+        fprintf(stderr, "xbattbar: config path too long\n");
+        _exit(1);
+      }
+      strcpy(config_path, optarg);
+      break;
+
+    case OPT_ANIMATE:
+      anim_fps = atoi(optarg);
+      if (anim_fps < 0) anim_fps = 0;
+      if (anim_fps > AnimMaxFps) anim_fps = AnimMaxFps;
       break;
 
     case 'h':
     case 'v':
+    default:
       usage(argv);
       break;
     }
@@ -288,71 +666,299 @@ main(int argc, char **argv)
   argv += optind;
 
   if (argc > 0) {
-    if (strcasecmp(*argv, "top") == 0)
-      bi_direction = BI_Top;
-    else if (strcasecmp(*argv, "bottom") == 0)
-      bi_direction = BI_Bottom;
-    else if (strcasecmp(*argv, "left") == 0)
-      bi_direction = BI_Left;
-    else if (strcasecmp(*argv, "right") == 0)
-      bi_direction = BI_Right;
+    bi_direction = parse_direction(*argv);
+    settings[S_POSITION].from_cli = True;
   }
 
+  if (!*config_path)
+    config_default_path();
+  load_config();
+
   /*
-   * set APM polling interval timer
+   * check APM polling interval
    */
-  if (!bi_interval) {
+  if (bi_interval <= 0) {
     fprintf(stderr,"xbattbar: can't set interval timer\n");
     _exit(1);
   }
-  alarm(bi_interval);
+
+  if (spark_mode != SPARK_NONE && segmented) {
+    fprintf(stderr, "xbattbar: --sparkline and --segmented exclude each other\n");
+    _exit(1);
+  }
+  if (anim_fps && (spark_mode != SPARK_NONE || segmented)) {
+    fprintf(stderr, "xbattbar: --animate needs the plain bar\n");
+    _exit(1);
+  }
+  if (spark_mode != SPARK_NONE && bi_thick < SparkMinThick) {
+    fprintf(stderr, "xbattbar: sparkline needs a thickness of at least %d\n",
+            SparkMinThick);
+    _exit(1);
+  }
 
   /*
-   * X Window main loop
+   * records are written whole, one flush per record
    */
-  InitDisplay();
-  signal(SIGALRM, (void *)(battery_check));
-  battery_check();
-  XSelectInput(disp, winbar, myEventMask);
-  while (1) {
-    XWindowEvent(disp, winbar, myEventMask, &theEvent);
-    switch (theEvent.type) {
-    case Expose:
-      /* we redraw our window since our window has been exposed. */
-      redraw();
-      break;
+  if (headless)
+    setvbuf(stdout, NULL, _IOFBF, BUFSIZ);
+  else {
+    InitDisplay();
+    if (spark_mode != SPARK_NONE)
+      init_sparkline();
+    if (anim_fps)
+      init_animation();
+    init_meters();
+  }
 
-    case EnterNotify:
-      /* create battery status message */
-      showdiagbox();
-      break;
+  for (ch = 0; ch < PFD_MAX; ch++)
+    pfd[ch].fd = -1;
+  init_signals();
+  init_config_watch();
+  if (metrics_path)
+    init_metrics();
+  if (replay_path)
+    init_replay(replay_path);
+  else
+    init_uevent();
+
+  sample();
+  if (!headless)
+    XSelectInput(disp, winbar, myEventMask);
+  main_loop();
+  return 0;
+}
 
-    case LeaveNotify:
-      /* destroy status window */
-      disposediagbox();
-      break;
+/*
+ * now_ms:
+ * monotonic clock in milliseconds, used by the scheduler
+ */
+long long now_ms(void)
+{
+  struct timespec ts;
 
-    case VisibilityNotify:
-      if (alwaysontop) XRaiseWindow(disp, winbar);
-      break;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    default:
-      /* for debugging */
-      fprintf(stderr,
-	      "xbattbar: unknown event (%d) captured\n",
-	      theEvent.type);
+long long wall_ms(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+long long now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* CPU time used by this thread, in us */
+long long cpu_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * main_loop:
+ * wait for X events or the next polling time, whichever comes first.
+ * In headless mode there is no X connection and poll() only sleeps.
+ */
+void main_loop(void)
+{
+  long long now, wake;
+  int timeout;
+  char junk[16];
+  int i;
+
+  if (!headless)
+    pfd[PFD_X].fd = ConnectionNumber(disp);
+  pfd[PFD_SIGNAL].fd = sigpipe[0];
+  for (i = 0; i < PFD_MAX; i++)
+    pfd[i].events = POLLIN;
+
+  while (1) {
+    now = now_ms();
+    if (now >= next_sample)
+      sample();
+    if (now >= next_frame && anim_effect() != ANIM_NONE)
+      anim_frame();
+
+    if (!headless) {
+      /* XPending() also flushes the output buffer before we sleep */
+      while (XPending(disp)) {
+        XNextEvent(disp, &theEvent);
+        stats.events++;
+        handle_event(&theEvent);
+      }
+    }
+
+    now = now_ms();
+    wake = next_sample;
+    if (next_frame < wake && anim_effect() != ANIM_NONE)
+      wake = next_frame;
+    timeout = wake > now ? (int)(wake - now) : 0;
+    if (poll(pfd, PFD_MAX, timeout) == -1 && errno != EINTR) {
+      perror("xbattbar: poll");
+      _exit(1);
+    }
+    stats.wakeups++;
+
+    if (pfd[PFD_SIGNAL].revents & POLLIN)
+      while (read(sigpipe[0], junk, sizeof(junk)) > 0)
+        ;
+    if (dump_requested) {
+      dump_requested = 0;
+      dump_metrics(fileno(stderr), 0);
     }
+    if (pfd[PFD_METRICS].revents & POLLIN)
+      serve_metrics();
+
+    /* a power_supply change: sample now instead of at the next tick */
+    if ((pfd[PFD_UEVENT].revents & POLLIN) && read_uevent())
+      next_sample = 0;
+
+    if ((pfd[PFD_CONFIG].revents & POLLIN) && read_config_watch())
+      load_config();
+  }
+}
+
+void handle_event(XEvent *ev)
+{
+  struct meter *m;
+
+  if (ev->xany.window != winbar) {
+    if ((m = find_meter(ev->xany.window)) == NULL)
+      return;
+    if (ev->type == Expose) {
+      m->pos = -1;
+      draw_meter(m);
+    } else if (ev->type == VisibilityNotify && alwaysontop)
+      XRaiseWindow(disp, m->win);
+    return;
+  }
+
+  switch (ev->type) {
+  case Expose:
+    /* we redraw our window since our window has been exposed. */
+    redraw();
+    break;
+
+  case EnterNotify:
+    /* create battery status message */
+    showdiagbox();
+    break;
+
+  case LeaveNotify:
+    /* destroy status window */
+    disposediagbox();
+    break;
+
+  case VisibilityNotify:
+    /* animation pauses while nothing of the bar can be seen */
+    bar_obscured = ev->xvisibility.state == VisibilityFullyObscured;
+    if (alwaysontop) XRaiseWindow(disp, winbar);
+    break;
+
+  default:
+    /* for debugging */
+    fprintf(stderr,
+            "xbattbar: unknown event (%d) captured\n",
+            ev->type);
+  }
+}
+
+/*
+ * sample:
+ * one tick of the scheduler: poll the battery, update the estimation
+ * and publish the result to the bar or to stdout.
+ */
+void sample(void)
+{
+  int ok;
+
+  if (replay_fp)
+    ok = replay_check();
+  else
+    ok = battery_check();
+  if (ok && record_fp)
+    record_sample();
+  if (ok) {
+    analyze_sample();
+    check_actions();
+  }
+  if (estimate_remain() && replay_fp)
+    replay_score();
+  if (headless)
+    emit_record();
+  else {
+    if (spark_mode != SPARK_NONE)
+      spark_push();
+    redraw();
+    sample_meters();
   }
+  if (replay_fp)
+    next_sample = replay_next();
+  else
+    next_sample = now_ms() + bi_interval * 1000LL;
+}
+
+/*
+ * emit_record:
+ * print one key=value line whenever the battery state has changed
+ */
+void emit_record(void)
+{
+  static int last_level = -1, last_ac = -1;
+  char buf[128];
+
+  if (battery_level == -1)
+    return;
+  if (battery_level == last_level && ac_line == last_ac)
+    return;
+  last_level = battery_level;
+  last_ac = ac_line;
+
+  format_health(buf, sizeof(buf), False);
+  printf("time=%lld battery=%d ac_line=%s state=%s remain=%d%s\n",
+         sample_time / 1000, battery_level, ac_line ? "on" : "off",
+         remain_sec == -1 ? "unknown" :
+         remain_charging ? "charging" : "discharging",
+         remain_sec, buf);
+  fflush(stdout);
 }
 
 void redraw(void)
 {
-  if (ac_line) {
+  long long t0 = now_us();
+  unsigned long seq = NextRequest(disp);
+
+  if (spark_mode != SPARK_NONE) {
+    XCopyArea(disp, spark_pix, winbar, gccopy,
+              0, 0, bi_width, bi_height, 0, 0);
+  } else if (segmented && npacks > 0) {
+    segmented_proc();
+  } else if (ac_line) {
     plug_proc(battery_level);
   } else {
     battery_proc(battery_level);
   }
-  estimate_remain();
+  if (anim_pix) {
+    /* the bar was drawn into the back buffer; this also wipes any
+     * animation from the window */
+    XCopyArea(disp, anim_pix, winbar, gccopy,
+              0, 0, bi_width, bi_height, 0, 0);
+    anim.len = anim.phase = 0;
+  }
+  stats.redraws++;
+  stats.x_requests += NextRequest(disp) - seq;
+  hist_add(&stats.render, now_us() - t0);
 }
 
 
@@ -363,17 +969,27 @@ void showdiagbox(void)
   XGCValues theGC;
   int pixw, pixh;
   int boxw, boxh;
-  char diagmsg[64];
+  char diagmsg[2][128];
+  int lines, i, w, len;
 
   /* compose diag message and calculate its size in pixels */
-  sprintf(diagmsg,
-         "AC %s-line: battery level is %d%%",
-         ac_line ? "on" : "off", battery_level);
+  len = sprintf(diagmsg[0],
+               "AC %s-line: battery level is %d%%",
+               ac_line ? "on" : "off", battery_level);
+  for (i = 0; npacks > 1 && i < npacks; i++)
+    len += sprintf(diagmsg[0] + len, "%s%d%%%s",
+                   i ? ", " : " (", packs[i].level,
+                   i == npacks - 1 ? ")" : "");
+  lines = 1 + format_health(diagmsg[1], sizeof(diagmsg[1]), True);
   fontp = XLoadQueryFont(disp, DefaultFont);
-  pixw = XTextWidth(fontp, diagmsg, strlen(diagmsg));
+  pixw = 0;
+  for (i = 0; i < lines; i++) {
+    w = XTextWidth(fontp, diagmsg[i], strlen(diagmsg[i]));
+    if (w > pixw) pixw = w;
+  }
   pixh = fontp->ascent + fontp->descent;
   boxw = pixw + DiagXMergin * 2;
-  boxh = pixh + DiagYMergin * 2;
+  boxh = pixh * lines + DiagYMergin * 2;
 
   /* create status window */
   if(winstat != -1) disposediagbox();
@@ -388,10 +1004,11 @@ void showdiagbox(void)
   XMapWindow(disp, winstat);
   theGC.font = fontp->fid;
   gcstat = XCreateGC(disp, winstat, GCFont, &theGC);
-  XDrawString(disp, winstat,
-             gcstat,
-             DiagXMergin, fontp->ascent+DiagYMergin,
-             diagmsg, strlen(diagmsg));
+  for (i = 0; i < lines; i++)
+    XDrawString(disp, winstat,
+               gcstat,
+               DiagXMergin, fontp->ascent+DiagYMergin + i*pixh,
+               diagmsg[i], strlen(diagmsg[i]));
 }
 
 void disposediagbox(void)
@@ -408,16 +1025,78 @@ void battery_proc(int left)
   if (BI_Horizontal) {
     pos = width * left / 100;
     XSetForeground(disp, gcbar, offin);
-    XFillRectangle(disp, winbar, gcbar, 0, 0, pos, bi_thick);
+    XFillRectangle(disp, bardraw, gcbar, 0, 0, pos, bi_thick);
     XSetForeground(disp, gcbar, offout);
-    XFillRectangle(disp, winbar, gcbar, pos, 0, width, bi_thick);
+    XFillRectangle(disp, bardraw, gcbar, pos, 0, width, bi_thick);
   } else {
     pos = height * left / 100;
     XSetForeground(disp, gcbar, offin);
-    XFillRectangle(disp, winbar, gcbar, 0, height-pos, bi_thick, height);
+    XFillRectangle(disp, bardraw, gcbar, 0, height-pos, bi_thick, height);
     XSetForeground(disp, gcbar, offout);
-    XFillRectangle(disp, winbar, gcbar, 0, 0, bi_thick, height-pos);
+    XFillRectangle(disp, bardraw, gcbar, 0, 0, bi_thick, height-pos);
+  }
+  XFlush(disp);
+}
+
+/*
+ * segmented_proc:
+ * one segment per battery, as long as its share of the total capacity
+ * (equal shares if a capacity is unknown), filled by its own level in
+ * the colors of its own charge state.  All rectangles of one color go
+ * out in a single XFillRectangles request.
+ */
+void segmented_proc(void)
+{
+  enum { C_ONIN, C_ONOUT, C_OFFIN, C_OFFOUT, C_MAX };
+  unsigned long pixel[C_MAX];
+  XRectangle rect[C_MAX][MaxBatteries], *r;
+  int nrect[C_MAX] = { 0, 0, 0, 0 };
+  long long total = 0, cum = 0;
+  int len = BI_Horizontal ? width : height;
+  int i, c, start, end, fill, equal = False;
+
+  pixel[C_ONIN] = onin;
+  pixel[C_ONOUT] = onout;
+  pixel[C_OFFIN] = offin;
+  pixel[C_OFFOUT] = offout;
+
+  for (i = 0; i < npacks; i++) {
+    if (packs[i].full <= 0)
+      equal = True;
+    total += packs[i].full;
   }
+  if (equal)
+    total = npacks;
+
+  for (i = 0, start = 0; i < npacks; i++, start = end) {
+    cum += equal ? 1 : packs[i].full;
+    end = len * cum / total;
+    fill = (end - start) * packs[i].level / 100;
+    c = packs[i].discharging ? C_OFFIN : C_ONIN;
+
+    r = &rect[c][nrect[c]++];
+    if (BI_Horizontal) {
+      r->x = start; r->y = 0; r->width = fill; r->height = bi_thick;
+    } else {
+      r->x = 0; r->y = height - start - fill;
+      r->width = bi_thick; r->height = fill;
+    }
+    c++;    /* the matching "out" color */
+    r = &rect[c][nrect[c]++];
+    if (BI_Horizontal) {
+      r->x = start + fill; r->y = 0;
+      r->width = end - start - fill; r->height = bi_thick;
+    } else {
+      r->x = 0; r->y = height - end;
+      r->width = bi_thick; r->height = end - start - fill;
+    }
+  }
+
+  for (c = 0; c < C_MAX; c++)
+    if (nrect[c]) {
+      XSetForeground(disp, gcbar, pixel[c]);
+      XFillRectangles(disp, bardraw, gcbar, rect[c], nrect[c]);
+    }
   XFlush(disp);
 }
 
@@ -428,15 +1107,15 @@ void plug_proc(int left)
   if (BI_Horizontal) {
     pos = width * left / 100;
     XSetForeground(disp, gcbar, onin);
-    XFillRectangle(disp, winbar, gcbar, 0, 0, pos, bi_thick);
+    XFillRectangle(disp, bardraw, gcbar, 0, 0, pos, bi_thick);
     XSetForeground(disp, gcbar, onout);
-    XFillRectangle(disp, winbar, gcbar, pos+1, 0, width, bi_thick);
+    XFillRectangle(disp, bardraw, gcbar, pos+1, 0, width, bi_thick);
   } else {
     pos = height * left / 100;
     XSetForeground(disp, gcbar, onin);
-    XFillRectangle(disp, winbar, gcbar, 0, height-pos, bi_thick, height);
+    XFillRectangle(disp, bardraw, gcbar, 0, height-pos, bi_thick, height);
     XSetForeground(disp, gcbar, onout);
-    XFillRectangle(disp, winbar, gcbar, 0, 0, bi_thick, height-pos);
+    XFillRectangle(disp, bardraw, gcbar, 0, 0, bi_thick, height-pos);
   }
   XFlush(disp);
 }
@@ -448,41 +1127,50 @@ void plug_proc(int left)
 
 #define CriticalLevel  5
 
-void estimate_remain()
+int estimate_remain()
 {
   static int battery_base = -1;
+  static long long base_time;
   int diff;
   int remain;
 
   /* static value initialize */
   if (battery_base == -1) {
     battery_base = battery_level;
-    return;
+    base_time = sample_time;
+    return 0;
   }
 
   diff = battery_base - battery_level;
 
-  if (diff == 0) return;
+  if (diff == 0) return 0;
 
   /* estimated time for battery remains */
   if (diff > 0) {
-    remain = elapsed_time * (battery_level - CriticalLevel) / diff ;
-    remain = remain * bi_interval;  /* in sec */
+    remain = (sample_time - base_time) / 1000
+      * (battery_level - CriticalLevel) / diff;  /* in sec */
     if (remain < 0 ) remain = 0;
-    printf("battery remain: %2d hr. %2d min. %2d sec.\n",
-	   remain / 3600, (remain % 3600) / 60, remain % 60);
-    elapsed_time = 0;
+    remain_sec = remain;
+    remain_charging = False;
+    if (!headless)
+      printf("battery remain: %2d hr. %2d min. %2d sec.\n",
+             remain / 3600, (remain % 3600) / 60, remain % 60);
+    base_time = sample_time;
     battery_base = battery_level;
-    return;
+    return 1;
   }
 
   /* estimated time of battery charging */
-  remain = elapsed_time * (battery_level - 100) / diff;
-  remain = remain * bi_interval;  /* in sec */
-  printf("charging remain: %2d hr. %2d min. %2d sec.\n",
-	 remain / 3600, (remain % 3600) / 60, remain % 60);
-  elapsed_time = 0;
+  remain = (sample_time - base_time) / 1000
+    * (battery_level - 100) / diff;  /* in sec */
+  remain_sec = remain;
+  remain_charging = True;
+  if (!headless)
+    printf("charging remain: %2d hr. %2d min. %2d sec.\n",
+           remain / 3600, (remain % 3600) / 60, remain % 60);
+  base_time = sample_time;
   battery_base = battery_level;
+  return 1;
 }
 
 #define TEMP_BUFFER_SIZE 4096
@@ -502,6 +1190,7 @@ int read_pipe(int pipe, char *buffer)
 #define AC_LINE_STRING		"ac_line="
 void print_script_error(void)
 {
+	stats.parse_errors++;
 	fprintf(stderr, "\nExternal script must print two strings:\n"
 		"\t" BATTERY_STRING "value between 0 and 100\n"
 		"\t" AC_LINE_STRING "on|off\n"
@@ -515,11 +1204,114 @@ void print_script_error(void)
 
 }
 
-void battery_check(void)
+/*
+ * find_key:
+ * value of an optional "key=value" in checker output, NULL if absent
+ */
+char *find_key(char *buffer, char *key)
+{
+	char *str;
+
+	for (str = strstr(buffer, key); str; str = strstr(str + 1, key)) {
+		/* the key must start a word: don't take energy_full= for
+		 * ..._energy_full= */
+		if (str != buffer && str[-1] != '\n' && str[-1] != ' ')
+			continue;
+		return str + strlen(key);
+	}
+	return NULL;
+}
+
+/*
+ * parse_value:
+ * optional non-negative numeric value from checker output, -1 if absent
+ */
+long long parse_value(char *buffer, char *key)
+{
+	char *str, *end;
+	long long v;
+
+	if ((str = find_key(buffer, key)) == NULL)
+		return -1;
+	v = strtoll(str, &end, 10);
+	if (end == str || v < 0)
+		return -1;
+	return v;
+}
+
+/*
+ * parse_status:
+ * pick the battery state out of checker output (or a trace line).
+ * Returns 0 if the mandatory battery= value is missing or malformed.
+ */
+int parse_status(char *buffer)
+{
+	char *str, *end;
+	int level;
+
+	str = strstr(buffer, BATTERY_STRING);
+	if (!str)
+		return 0;
+
+	str += sizeof(BATTERY_STRING) - 1;
+	if (!*str)
+		return 0;
+
+	level = strtol(str, &end, 10);
+	if ((*end != '\n' && *end != '.' &&
+		*end != '\0' &&
+		*end != ' ' && *end != '%') || end == str)
+		return 0;
+
+	battery_level = level;
+	if (battery_level > 100)
+		fprintf(stderr, "Incorrect battery level "
+		" has been received: %d%%\n", battery_level);
+
+	if (strstr(buffer, AC_LINE_STRING "on"))
+		ac_line = 1;
+	else
+		ac_line = 0;
+
+	energy_now = parse_value(buffer, "energy_now=");
+	energy_full = parse_value(buffer, "energy_full=");
+	energy_full_design = parse_value(buffer, "energy_full_design=");
+	power_now = parse_value(buffer, "power_now=");
+
+	/* packs are numbered from 0 without gaps */
+	for (npacks = 0; npacks < MaxBatteries; npacks++) {
+		struct pack *b = &packs[npacks];
+		char key[32], *str;
+
+		snprintf(key, sizeof(key), "battery%d=", npacks);
+		if ((b->level = parse_value(buffer, key)) == -1)
+			break;
+		if (b->level > 100)
+			b->level = 100;
+		snprintf(key, sizeof(key), "status%d=", npacks);
+		if ((str = find_key(buffer, key)) != NULL) {
+			b->discharging = strncmp(str, "Discharging", 11) == 0;
+			b->charging = strncmp(str, "Charging", 8) == 0;
+		} else {
+			b->discharging = !ac_line;
+			b->charging = -1;
+		}
+		snprintf(key, sizeof(key), "energy_full%d=", npacks);
+		b->full = parse_value(buffer, key);
+	}
+
+	meters_from_status(buffer);
+	return 1;
+}
+
+int battery_check(void)
 {
 	int p[2], pid;
 	char buffer[TEMP_BUFFER_SIZE];
+	long long t0 = now_us(), t1;
 
+	stats.samples++;
+	sample_time = wall_ms();
 	if (pipe(p) != 0) {
 		perror("error create pipe");
 		goto exit_check;
@@ -537,7 +1329,6 @@ void battery_check(void)
 	if (pid) { /* parent */
 		int len, status;
 		close(p[1]);
-		char *str, *end;
 
 		pid = waitpid(pid, &status, 0);
 		if (pid == -1) {
@@ -553,46 +1344,20 @@ void battery_check(void)
 				EXTERNAL_CHECK, WEXITSTATUS(status));
 			len = read_pipe(p[0], buffer);
 			if (len > 0)
-				printf("%s\n", buffer);
+				fprintf(stderr, "%s\n", buffer);
 			close(p[0]);
 			goto exit_check;
 		}
 
 		len = read_pipe(p[0], buffer);
 		close(p[0]);
-		if (!len) {
-			print_script_error();
-			goto exit_check;
-		}
-
-		str = strstr(buffer, BATTERY_STRING);
-		if (!str) {
-			print_script_error();
-			goto exit_check;
-		}
-
-		str += sizeof(BATTERY_STRING) - 1;
-		if (!*str) {
-			print_script_error();
-			goto exit_check;
-		}
-
-		status = strtol(str, &end, 10);
-		if ((*end != '\n' && *end != '.' &&
-			*end != '\0' &&
-			*end != ' ' && *end != '%') || end == str) {
+		t1 = now_us();
+		hist_add(&stats.spawn, t1 - t0);
+		if (!len || !parse_status(buffer)) {
 			print_script_error();
 			goto exit_check;
 		}
-		battery_level = status;
-		if (battery_level > 100)
-			fprintf(stderr, "Incorrect battery level "
-			" has been received: %d%%\n", battery_level);
-
-		if (strstr(buffer, AC_LINE_STRING "on"))
-			ac_line = 1;
-		else
-			ac_line = 0;
+		hist_add(&stats.parse, now_us() - t1);
 
 /*                 printf("Received battery level: %d%%, ac_line: %s\n", */
 /*                         battery_level, ac_line?"on":"off"); */
@@ -610,11 +1375,1292 @@ void battery_check(void)
 		_exit(-1);
 	}
 
+	return 1;
+
 	exit_check:
-	elapsed_time++;
-	redraw();
-	signal(SIGALRM, (void *)(battery_check));
-	alarm(bi_interval);
+	stats.sample_errors++;
+	return 0;
+}
+
+/*
+ * trace record / replay
+ *
+ * A trace is a text file with one sample per line, in the format of
+ * checker output plus the wall clock time of the sample in ms:
+ *	t=1700000000000 battery=57 ac_line=off
+ * Blank lines and lines starting with '#' are ignored.
+ */
+
+struct {
+  char line[TEMP_BUFFER_SIZE];  /* next sample to be played */
+  int have_line;
+  unsigned long lineno;
+  long long t;                  /* trace time of that sample */
+  long long t_first;            /* trace time of the first sample */
+  long long start;              /* now_ms() when replay started */
+  long long start_us;
+  long long t_crit;             /* first critical sample on battery */
+  unsigned long samples;
+  unsigned long estimates;      /* scored estimates before t_crit */
+  double sum_err, sum_abs, sum_sq;
+} replay;
+
+void record_sample(void)
+{
+	int i;
+
+	fprintf(record_fp, "t=%lld battery=%d ac_line=%s",
+		sample_time, battery_level, ac_line ? "on" : "off");
+	if (energy_now != -1)
+		fprintf(record_fp, " energy_now=%lld", energy_now);
+	if (energy_full != -1)
+		fprintf(record_fp, " energy_full=%lld", energy_full);
+	if (energy_full_design != -1)
+		fprintf(record_fp, " energy_full_design=%lld",
+			energy_full_design);
+	if (power_now != -1)
+		fprintf(record_fp, " power_now=%lld", power_now);
+	for (i = 0; i < npacks; i++) {
+		fprintf(record_fp, " battery%d=%d", i, packs[i].level);
+		if (packs[i].charging != -1)
+			fprintf(record_fp, " status%d=%s", i,
+				packs[i].discharging ? "Discharging" :
+				packs[i].charging ? "Charging" : "Not_charging");
+		if (packs[i].full != -1)
+			fprintf(record_fp, " energy_full%d=%lld",
+				i, packs[i].full);
+	}
+	fprintf(record_fp, "\n");
+}
+
+/* read the next usable trace line into replay.line */
+static void replay_read(void)
+{
+	char *str, *end;
+
+	replay.have_line = 0;
+	while (fgets(replay.line, sizeof(replay.line), replay_fp)) {
+		replay.lineno++;
+		str = replay.line + strspn(replay.line, " \t");
+		if (*str == '#' || *str == '\n' || *str == '\0')
+			continue;
+		if (strncmp(str, "t=", 2) != 0 ||
+		    (replay.t = strtoll(str + 2, &end, 10), end == str + 2)) {
+			fprintf(stderr, "xbattbar: replay line %lu: "
+				"no t= timestamp\n", replay.lineno);
+			continue;
+		}
+		replay.have_line = 1;
+		return;
+	}
 }
 
+/*
+ * init_replay:
+ * open the trace, find the ground truth for the estimator (the time the
+ * battery first reaches CriticalLevel on battery) and queue the first
+ * sample
+ */
+void init_replay(char *path)
+{
+	if ((replay_fp = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "xbattbar: %s: %s\n", path, strerror(errno));
+		_exit(1);
+	}
+
+	replay.t_crit = -1;
+	for (replay_read(); replay.have_line; replay_read())
+		if (parse_status(replay.line) && !ac_line &&
+		    battery_level <= CriticalLevel) {
+			replay.t_crit = replay.t;
+			break;
+		}
+	battery_level = ac_line = -1;
+
+	if (fseek(replay_fp, 0, SEEK_SET) != 0) {
+		fprintf(stderr, "xbattbar: %s: trace must be seekable\n", path);
+		_exit(1);
+	}
+	replay.lineno = 0;
+	replay_read();
+	if (!replay.have_line) {
+		fprintf(stderr, "xbattbar: %s: empty trace\n", path);
+		_exit(1);
+	}
+	replay.t_first = replay.t;
+	replay.start = now_ms();
+	replay.start_us = now_us();
+}
+
+/*
+ * replay_finish:
+ * report throughput and estimator accuracy as one key=value line
+ */
+static void replay_finish(void)
+{
+	double secs;
+
+	if (!headless)
+		XSync(disp, False);
+	secs = (now_us() - replay.start_us) / 1e6;
+
+	fprintf(stderr, "replay samples=%lu seconds=%.3f samples_per_sec=%.0f "
+		"redraws=%lu",
+		replay.samples, secs, secs > 0 ? replay.samples / secs : 0,
+		stats.redraws);
+	if (replay.estimates)
+		fprintf(stderr, " estimates=%lu mae=%.0f rmse=%.0f bias=%.0f",
+			replay.estimates,
+			replay.sum_abs / replay.estimates,
+			sqrt(replay.sum_sq / replay.estimates),
+			replay.sum_err / replay.estimates);
+	else
+		fprintf(stderr, " estimates=0");
+	fprintf(stderr, "\n");
+	fflush(stdout);
+	exit(0);
+}
+
+int replay_check(void)
+{
+	if (!replay.have_line)
+		replay_finish();
+
+	stats.samples++;
+	replay.samples++;
+	sample_time = replay.t;
+	if (!parse_status(replay.line)) {
+		fprintf(stderr, "xbattbar: replay line %lu: no battery value\n",
+			replay.lineno);
+		stats.parse_errors++;
+		stats.sample_errors++;
+		replay_read();
+		return 0;
+	}
+	replay_read();
+	return 1;
+}
+
+/*
+ * replay_next:
+ * when the next trace sample is due; at speed 0 it is due at once
+ */
+long long replay_next(void)
+{
+	if (!replay.have_line || replay_speed <= 0)
+		return now_ms();
+	return replay.start + (replay.t - replay.t_first) / replay_speed;
+}
+
+/*
+ * replay_score:
+ * compare a fresh discharge estimate with the real time left
+ */
+void replay_score(void)
+{
+	double err;
+
+	if (replay.t_crit < 0 || remain_charging || sample_time >= replay.t_crit)
+		return;
+	err = remain_sec - (replay.t_crit - sample_time) / 1000.0;
+	replay.estimates++;
+	replay.sum_err += err;
+	replay.sum_abs += err < 0 ? -err : err;
+	replay.sum_sq += err * err;
+}
+
+
 
+
+/*
+ * self instrumentation
+ */
+
+void hist_add(struct histogram *h, long long us)
+{
+  int i = 0;
+
+  if (us < 0) us = 0;
+  h->count++;
+  h->sum_us += us;
+  while (i < HistBuckets - 1 && us >= (1LL << i))
+    i++;
+  h->bucket[i]++;
+}
+
+void sigusr1_handler(int sig)
+{
+  int saved = errno;
+
+  dump_requested = 1;
+  if (write(sigpipe[1], "", 1) == -1)
+    ;  /* pipe full: a wakeup is already pending */
+  errno = saved;
+}
+
+/*
+ * init_signals:
+ * signal handlers only set a flag and poke the self-pipe so that the
+ * main loop wakes up and does the real work
+ */
+void init_signals(void)
+{
+  struct sigaction sa;
+  int i;
+
+  if (pipe(sigpipe) != 0) {
+    perror("xbattbar: pipe");
+    _exit(1);
+  }
+  for (i = 0; i < 2; i++) {
+    fcntl(sigpipe[i], F_SETFL, O_NONBLOCK);
+    fcntl(sigpipe[i], F_SETFD, FD_CLOEXEC);
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = sigusr1_handler;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR1, &sa, NULL);
+}
+
+/*
+ * init_metrics:
+ * listen on a UNIX socket; every connection receives one dump
+ */
+void init_metrics(void)
+{
+  struct sockaddr_un sun;
+  int fd;
+
+  if (strlen(metrics_path) >= sizeof(sun.sun_path)) {
+    fprintf(stderr, "xbattbar: metrics socket path too long\n");
+    _exit(1);
+  }
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  strcpy(sun.sun_path, metrics_path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) {
+    perror("xbattbar: socket");
+    _exit(1);
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  unlink(metrics_path);
+  if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1 ||
+      listen(fd, 4) == -1) {
+    fprintf(stderr, "xbattbar: can't listen on %s: %s\n",
+            metrics_path, strerror(errno));
+    _exit(1);
+  }
+  pfd[PFD_METRICS].fd = fd;
+}
+
+void serve_metrics(void)
+{
+  int fd;
+
+  while ((fd = accept(pfd[PFD_METRICS].fd, NULL, NULL)) != -1) {
+    fcntl(fd, F_SETFL, 0);
+    dump_metrics(fd, 1);
+    close(fd);
+  }
+}
+
+/*
+ * dump_metrics:
+ * write all counters in the Prometheus text exposition format
+ */
+#define MetricsBufSize 8192
+
+static char metrics_buf[MetricsBufSize];
+static int metrics_len;
+
+static void mprintf(const char *fmt, ...)
+  __attribute__((format(printf, 1, 2)));
+
+static void mprintf(const char *fmt, ...)
+{
+  va_list ap;
+  int n;
+
+  if (metrics_len >= MetricsBufSize)
+    return;
+  va_start(ap, fmt);
+  n = vsnprintf(metrics_buf + metrics_len, MetricsBufSize - metrics_len,
+                fmt, ap);
+  va_end(ap);
+  if (n > 0)
+    metrics_len += n;
+}
+
+static void mcounter(const char *name, const char *help, unsigned long v)
+{
+  mprintf("# HELP xbattbar_%s %s\n# TYPE xbattbar_%s counter\n"
+          "xbattbar_%s %lu\n", name, help, name, name, v);
+}
+
+static void mhist(const char *name, const char *help, struct histogram *h)
+{
+  unsigned long cum = 0;
+  int i;
+
+  mprintf("# HELP xbattbar_%s %s\n# TYPE xbattbar_%s histogram\n",
+          name, help, name);
+  for (i = 0; i < HistBuckets - 1; i++) {
+    cum += h->bucket[i];
+    mprintf("xbattbar_%s_bucket{le=\"%g\"} %lu\n",
+            name, (double)(1LL << i) / 1e6, cum);
+  }
+  mprintf("xbattbar_%s_bucket{le=\"+Inf\"} %lu\n", name, h->count);
+  mprintf("xbattbar_%s_sum %g\nxbattbar_%s_count %lu\n",
+          name, h->sum_us / 1e6, name, h->count);
+}
+
+/*
+ * read utime, stime and rss of this process from /proc/self/stat
+ */
+static void mprocstat(void)
+{
+  char buf[1024], *p;
+  unsigned long utime, stime;
+  long rss;
+  long hz = sysconf(_SC_CLK_TCK);
+  int fd, n;
+
+  if ((fd = open("/proc/self/stat", O_RDONLY)) == -1)
+    return;
+  n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0)
+    return;
+  buf[n] = 0;
+
+  /* the command name may contain blanks, so skip past its ')' */
+  if ((p = strrchr(buf, ')')) == NULL)
+    return;
+  if (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+             "%lu %lu %*d %*d %*d %*d %*d %*d %*u %*u %ld",
+             &utime, &stime, &rss) != 3)
+    return;
+
+  mprintf("# HELP xbattbar_cpu_seconds_total CPU time used by xbattbar\n"
+          "# TYPE xbattbar_cpu_seconds_total counter\n"
+          "xbattbar_cpu_seconds_total{mode=\"user\"} %g\n"
+          "xbattbar_cpu_seconds_total{mode=\"system\"} %g\n",
+          (double)utime / hz, (double)stime / hz);
+  mprintf("# HELP xbattbar_resident_memory_bytes resident set size\n"
+          "# TYPE xbattbar_resident_memory_bytes gauge\n"
+          "xbattbar_resident_memory_bytes %ld\n",
+          rss * sysconf(_SC_PAGESIZE));
+}
+
+void dump_metrics(int fd, int sock)
+{
+  int off, n;
+
+  metrics_len = 0;
+  mcounter("samples_total", "battery samples taken", stats.samples);
+  mcounter("sample_errors_total", "samples which gave no battery value",
+           stats.sample_errors);
+  mcounter("parse_errors_total", "checker outputs not understood",
+           stats.parse_errors);
+  mcounter("redraws_total", "bar repaints", stats.redraws);
+  mcounter("x_requests_total", "X requests issued by repaints",
+           stats.x_requests);
+  mcounter("wakeups_total", "main loop wakeups", stats.wakeups);
+  mcounter("x_events_total", "X events handled", stats.events);
+  mcounter("uevents_total", "power_supply uevents received", stats.uevents);
+  mcounter("actions_total", "threshold actions started", stats.actions);
+  mcounter("config_reloads_total", "config file reloads", stats.reloads);
+  mhist("spawn_seconds", "checker run time", &stats.spawn);
+  mhist("parse_seconds", "checker output parse time", &stats.parse);
+  mhist("render_seconds", "bar repaint time", &stats.render);
+  mcounter("frames_total", "animation frames drawn", stats.frames);
+  mhist("frame_cpu_seconds", "animation frame CPU time", &stats.frame);
+  mprocstat();
+
+  /*
+   * a scraper hanging up early must not kill us, but SIGPIPE stays at
+   * its default so that checkers and actions inherit it unchanged
+   */
+  for (off = 0; off < metrics_len; off += n) {
+    if (sock)
+      n = send(fd, metrics_buf + off, metrics_len - off, MSG_NOSIGNAL);
+    else
+      n = write(fd, metrics_buf + off, metrics_len - off);
+    if (n <= 0)
+      break;
+  }
+}
+
+
+/*
+ * battery health analytics
+ */
+
+/*
+ * analyze_sample:
+ * fold one sample into the capacity, cycle and discharge rate figures.
+ * Cycles count discharged energy in units of the design capacity (or of
+ * whole percents if the checker gives no energy values).
+ */
+void analyze_sample(void)
+{
+  long long full = energy_full_design > 0 ? energy_full_design : energy_full;
+  double rate = -1, delta;
+
+  if (energy_full > 0 && energy_full_design > 0)
+    health.capacity = 100.0 * energy_full / energy_full_design;
+
+  if (!ac_line) {
+    if (energy_now != -1 && health.last_energy != -1 && full > 0) {
+      delta = health.last_energy - energy_now;   /* uWh */
+      if (delta > 0) {
+        health.cycles += delta / full;
+        if (sample_time > health.last_energy_time)
+          rate = delta / 1e6 /
+                 ((sample_time - health.last_energy_time) / 3.6e6);
+      }
+    } else if (energy_now == -1 && health.last_level != -1 &&
+               battery_level < health.last_level) {
+      health.cycles += (health.last_level - battery_level) / 100.0;
+    }
+    if (power_now > 0)
+      rate = power_now / 1e6;
+
+    if (rate > 0) {
+      double d = rate - health.rate_mean;
+
+      health.n++;
+      health.rate_mean += d / health.n;
+      health.rate_m2 += d * (rate - health.rate_mean);
+      if (rate > health.rate_max)
+        health.rate_max = rate;
+    }
+  }
+
+  /*
+   * energy_now is only refreshed every so often by the firmware, so
+   * measure the drain over the span since it last moved, not since
+   * the previous sample.  On AC there is nothing to measure; keep
+   * the baseline current so the first discharge step starts fresh.
+   */
+  if (ac_line || energy_now != health.last_energy) {
+    health.last_energy = energy_now;
+    health.last_energy_time = sample_time;
+  }
+  health.last_level = battery_level;
+}
+
+/*
+ * format_health:
+ * the known figures either as text for the status window or as
+ * " key=value" pairs for the headless records.  Returns 0 if there
+ * is nothing to show.
+ */
+int format_health(char *buf, int size, int human)
+{
+  int len = 0;
+  double sd = health.n > 1 ? sqrt(health.rate_m2 / (health.n - 1)) : 0;
+
+  buf[0] = '\0';
+  if (human) {
+    if (health.capacity >= 0)
+      len += snprintf(buf + len, size - len, "capacity %.1f%% of design, ",
+                      health.capacity);
+    len += snprintf(buf + len, size - len, "%.2f cycles", health.cycles);
+    if (health.n)
+      len += snprintf(buf + len, size - len,
+                      ", drain %.1fW (sd %.1f, max %.1f)",
+                      health.rate_mean, sd, health.rate_max);
+    return health.capacity >= 0 || health.cycles > 0 || health.n;
+  }
+
+  if (health.capacity >= 0)
+    len += snprintf(buf + len, size - len, " capacity=%.1f",
+                    health.capacity);
+  len += snprintf(buf + len, size - len, " cycles=%.3f", health.cycles);
+  if (health.n)
+    len += snprintf(buf + len, size - len,
+                    " rate_mean=%.2f rate_sd=%.2f rate_max=%.2f",
+                    health.rate_mean, sd, health.rate_max);
+  return 1;
+}
+
+/*
+ * meters
+ */
+
+/* bar location name, "bottom" for anything unknown */
+int parse_direction(char *name)
+{
+  if (strcasecmp(name, "top") == 0)
+    return BI_Top;
+  if (strcasecmp(name, "left") == 0)
+    return BI_Left;
+  if (strcasecmp(name, "right") == 0)
+    return BI_Right;
+  return BI_Bottom;
+}
+
+/*
+ * add_meter:
+ * parse "source,min,max[,edge[,incolor[,outcolor]]]"
+ */
+void add_meter(char *spec)
+{
+  struct meter *m = &meters[nmeters];
+  char *field[6];
+  int n = 0;
+
+  if (nmeters == MaxMeters) {
+    fprintf(stderr, "xbattbar: too many meters (max %d)\n", MaxMeters);
+    _exit(1);
+  }
+  for (field[n++] = spec; n < 6 && (spec = strchr(spec, ',')); )
+    *spec++ = '\0', field[n++] = spec;
+  if (n < 3) {
+    fprintf(stderr, "xbattbar: meter must be source,min,max[,edge"
+            "[,color[,color]]]\n");
+    _exit(1);
+  }
+
+  if (strncmp(field[0], "file:", 5) == 0) {
+    m->kind = METER_FILE;
+    m->arg = field[0] + 5;
+  } else if (strncmp(field[0], "key:", 4) == 0) {
+    m->kind = METER_KEY;
+    if (snprintf(m->key, sizeof(m->key), "%s=", field[0] + 4)
+        >= (int)sizeof(m->key)) {
+      fprintf(stderr, "xbattbar: meter key %s too long\n", field[0] + 4);
+      _exit(1);
+    }
+    m->arg = m->key;
+  } else if (strcmp(field[0], "loadavg") == 0) {
+    m->kind = METER_LOADAVG;
+    m->arg = "/proc/loadavg";
+  } else {
+    fprintf(stderr, "xbattbar: unknown meter source %s\n", field[0]);
+    _exit(1);
+  }
+  m->min = atof(field[1]);
+  m->max = atof(field[2]);
+  if (m->max <= m->min) {
+    fprintf(stderr, "xbattbar: meter %s: max must exceed min\n", field[0]);
+    _exit(1);
+  }
+  m->follow = n <= 3;
+  if (!m->follow)
+    m->direction = parse_direction(field[3]);
+  m->in_c = n > 4 ? field[4] : "orange";
+  m->out_c = n > 5 ? field[5] : "gray30";
+  m->fd = -1;
+  m->value = NAN;
+  nmeters++;
+}
+
+/*
+ * place_meters:
+ * meters on the same edge are stacked inwards, next to the battery bar.
+ * Windows which already exist are moved.
+ */
+void place_meters(void)
+{
+  int offset[4] = { 0, 0, 0, 0 };
+  struct meter *m;
+
+  offset[bi_direction] = bi_thick;
+  for (m = meters; m < meters + nmeters; m++) {
+    if (m->follow)
+      m->direction = bi_direction;
+    bar_geometry(m->direction, offset[m->direction], bi_thick,
+                 &m->x, &m->y, &m->w, &m->h);
+    offset[m->direction] += bi_thick;
+    if (m->win) {
+      XMoveResizeWindow(disp, m->win, m->x, m->y, m->w, m->h);
+      m->pos = -1;
+    }
+  }
+}
+
+/*
+ * init_meters:
+ * create the meter windows
+ */
+void init_meters(void)
+{
+  XSetWindowAttributes att;
+  struct meter *m;
+
+  att.override_redirect = True;
+  place_meters();
+
+  for (m = meters; m < meters + nmeters; m++) {
+    if (!AllocColor(m->in_c, &m->in) || !AllocColor(m->out_c, &m->out)) {
+      fprintf(stderr, "xbattbar: can't allocate color resources\n");
+      _exit(1);
+    }
+    if (m->kind != METER_KEY &&
+        (m->fd = open(m->arg, O_RDONLY | O_CLOEXEC)) == -1)
+      fprintf(stderr, "xbattbar: %s: %s\n", m->arg, strerror(errno));
+
+    m->win = XCreateSimpleWindow(disp, DefaultRootWindow(disp),
+                                 m->x, m->y, m->w, m->h,
+                                 0, BlackPixel(disp,0), WhitePixel(disp,0));
+    XChangeWindowAttributes(disp, m->win, CWOverrideRedirect, &att);
+    XSelectInput(disp, m->win, ExposureMask|VisibilityChangeMask);
+    XMapWindow(disp, m->win);
+    m->pos = -1;
+  }
+}
+
+/*
+ * sample_meters:
+ * read every file meter once per polling period; sysfs and procfs
+ * regenerate the value on each read from offset 0
+ */
+void sample_meters(void)
+{
+  char buf[64];
+  struct meter *m;
+  int n;
+
+  for (m = meters; m < meters + nmeters; m++) {
+    if (m->fd != -1) {
+      n = pread(m->fd, buf, sizeof(buf) - 1, 0);
+      if (n > 0) {
+        buf[n] = '\0';
+        m->value = strtod(buf, NULL);
+      } else
+        m->value = NAN;
+    }
+    draw_meter(m);
+  }
+}
+
+/* key meters take their value from the battery checker output */
+void meters_from_status(char *buffer)
+{
+  struct meter *m;
+  long long v;
+
+  for (m = meters; m < meters + nmeters; m++)
+    if (m->kind == METER_KEY) {
+      v = parse_value(buffer, m->arg);
+      m->value = v == -1 ? NAN : v;
+    }
+}
+
+struct meter *find_meter(Window w)
+{
+  struct meter *m;
+
+  for (m = meters; m < meters + nmeters; m++)
+    if (m->win == w)
+      return m;
+  return NULL;
+}
+
+/*
+ * draw_meter:
+ * repaint only if the fill length has changed
+ */
+void draw_meter(struct meter *m)
+{
+  int len = m->direction == BI_Top || m->direction == BI_Bottom ? m->w : m->h;
+  int pos = 0;
+  unsigned long seq;
+
+  if (!isnan(m->value)) {
+    pos = len * (m->value - m->min) / (m->max - m->min);
+    if (pos < 0) pos = 0;
+    if (pos > len) pos = len;
+  }
+  if (pos == m->pos)
+    return;
+  m->pos = pos;
+
+  seq = NextRequest(disp);
+  if (m->direction == BI_Top || m->direction == BI_Bottom) {
+    XSetForeground(disp, gcbar, m->in);
+    XFillRectangle(disp, m->win, gcbar, 0, 0, pos, m->h);
+    XSetForeground(disp, gcbar, m->out);
+    XFillRectangle(disp, m->win, gcbar, pos, 0, m->w - pos, m->h);
+  } else {
+    XSetForeground(disp, gcbar, m->in);
+    XFillRectangle(disp, m->win, gcbar, 0, m->h - pos, m->w, pos);
+    XSetForeground(disp, gcbar, m->out);
+    XFillRectangle(disp, m->win, gcbar, 0, 0, m->w, m->h - pos);
+  }
+  stats.redraws++;
+  stats.x_requests += NextRequest(disp) - seq;
+}
+
+/*
+ * sparkline
+ */
+
+void set_sparkline(char *spec)
+{
+  if (strncmp(spec, "power", 5) == 0 && (spec[5] == '\0' || spec[5] == ',')) {
+    spark_mode = SPARK_POWER;
+    if (spec[5] == ',' && (spark_max = atof(spec + 6)) <= 0) {
+      fprintf(stderr, "xbattbar: sparkline watts must be positive\n");
+      _exit(1);
+    }
+  } else if (strcmp(spec, "level") == 0) {
+    spark_mode = SPARK_LEVEL;
+  } else {
+    fprintf(stderr, "xbattbar: sparkline must be power[,watts] or level\n");
+    _exit(1);
+  }
+}
+
+/*
+ * init_sparkline:
+ * (re)create the history pixmap for the current bar size; a resize
+ * starts with an empty history
+ */
+void init_sparkline(void)
+{
+  if (spark_pix)
+    XFreePixmap(disp, spark_pix);
+  spark_pix = XCreatePixmap(disp, winbar, bi_width, bi_height,
+                            DefaultDepth(disp, 0));
+  XSetForeground(disp, gccopy, offout);
+  XFillRectangle(disp, spark_pix, gccopy, 0, 0, bi_width, bi_height);
+}
+
+/*
+ * spark_push:
+ * scroll the history by one pixel and draw only the newest sample, so
+ * the X cost per sample doesn't depend on how much history is shown
+ */
+void spark_push(void)
+{
+  unsigned long seq = NextRequest(disp);
+  double v = -1;
+  int fill;
+
+  if (spark_mode == SPARK_LEVEL && battery_level != -1)
+    v = battery_level / 100.0;
+  else if (spark_mode == SPARK_POWER && power_now != -1)
+    v = power_now / 1e6 / spark_max;
+  if (v > 1) v = 1;
+  fill = v < 0 ? 0 : v * bi_thick + 0.5;
+
+  if (BI_Horizontal) {
+    /* time runs right to left, the value grows up from the bottom */
+    XCopyArea(disp, spark_pix, spark_pix, gccopy,
+              1, 0, bi_width - 1, bi_height, 0, 0);
+    XSetForeground(disp, gccopy, ac_line ? onout : offout);
+    XFillRectangle(disp, spark_pix, gccopy,
+                   bi_width - 1, 0, 1, bi_height - fill);
+    XSetForeground(disp, gccopy, ac_line ? onin : offin);
+    XFillRectangle(disp, spark_pix, gccopy,
+                   bi_width - 1, bi_height - fill, 1, fill);
+  } else {
+    /* time runs bottom to top, the value grows from the left */
+    XCopyArea(disp, spark_pix, spark_pix, gccopy,
+              0, 1, bi_width, bi_height - 1, 0, 0);
+    XSetForeground(disp, gccopy, ac_line ? onin : offin);
+    XFillRectangle(disp, spark_pix, gccopy,
+                   0, bi_height - 1, fill, 1);
+    XSetForeground(disp, gccopy, ac_line ? onout : offout);
+    XFillRectangle(disp, spark_pix, gccopy,
+                   fill, bi_height - 1, bi_width - fill, 1);
+  }
+  stats.x_requests += NextRequest(disp) - seq;
+}
+
+/*
+ * animation
+ */
+
+/*
+ * init_animation:
+ * (re)create the back buffer for the current bar size and make the
+ * bar drawing functions paint into it
+ */
+void init_animation(void)
+{
+  if (anim_pix)
+    XFreePixmap(disp, anim_pix);
+  anim_pix = XCreatePixmap(disp, winbar, bi_width, bi_height,
+                           DefaultDepth(disp, 0));
+  XSetForeground(disp, gccopy, onout);
+  XFillRectangle(disp, anim_pix, gccopy, 0, 0, bi_width, bi_height);
+  bardraw = anim_pix;
+  anim.len = anim.phase = 0;
+}
+
+/*
+ * anim_effect:
+ * what should be animated right now; ANIM_NONE stops the frames
+ */
+int anim_effect(void)
+{
+  int i, charging = -1;
+
+  if (!anim_pix || bar_obscured || battery_level < 0)
+    return ANIM_NONE;
+  if (ac_line) {
+    /*
+     * trust the packs' status where the checker gives one: a battery
+     * held below full by a charge threshold is not charging
+     */
+    for (i = 0; i < npacks; i++)
+      if (packs[i].charging != -1)
+        charging = charging == 1 ||
+          (packs[i].charging && !packs[i].discharging);
+    if (charging == -1)
+      charging = battery_level < 100;
+    return charging ? ANIM_CHARGE : ANIM_NONE;
+  }
+  return battery_level <= CriticalLevel ? ANIM_PULSE : ANIM_NONE;
+}
+
+/* the part [a, a+len) of the bar along its length, from the left/bottom */
+static void anim_rect(int a, int len, XRectangle *r)
+{
+  if (BI_Horizontal) {
+    r->x = a; r->y = 0; r->width = len; r->height = bi_thick;
+  } else {
+    r->x = 0; r->y = bi_height - a - len; r->width = bi_thick; r->height = len;
+  }
+}
+
+/*
+ * anim_frame:
+ * draw one frame, touching only the animated rectangles, and schedule
+ * the next one no sooner than the frame cap allows
+ */
+void anim_frame(void)
+{
+  long long t0 = cpu_us(), t = now_ms();
+  unsigned long seq = NextRequest(disp);
+  int pos = (BI_Horizontal ? bi_width : bi_height) * battery_level / 100;
+  int a, end, phase;
+  XRectangle r;
+
+  next_frame = t + 1000 / anim_fps;
+
+  if (anim_effect() == ANIM_CHARGE) {
+    /* put back what the last highlight covered ... */
+    if (anim.len > 0) {
+      anim_rect(anim.a, anim.len, &r);
+      XCopyArea(disp, anim_pix, winbar, gccopy,
+                r.x, r.y, r.width, r.height, r.x, r.y);
+    }
+    /* ... and draw it further along the charged part */
+    a = (t % AnimSweepMs) * (pos + AnimSlider) / AnimSweepMs - AnimSlider;
+    end = a + AnimSlider < pos ? a + AnimSlider : pos;
+    anim.a = a < 0 ? 0 : a;
+    anim.len = end > anim.a ? end - anim.a : 0;
+    if (anim.len > 0) {
+      anim_rect(anim.a, anim.len, &r);
+      XSetForeground(disp, gccopy, onout);
+      XFillRectangles(disp, winbar, gccopy, &r, 1);
+    }
+  } else {
+    /* the pulse only changes twice a period: sleep until then */
+    phase = (t / AnimPulseMs) % 2;
+    if ((t / AnimPulseMs + 1) * AnimPulseMs > next_frame)
+      next_frame = (t / AnimPulseMs + 1) * AnimPulseMs;
+    if (phase == anim.phase)
+      return;
+    anim.phase = phase;
+    anim_rect(0, pos, &r);
+    if (phase) {
+      XSetForeground(disp, gccopy, offout);
+      XFillRectangles(disp, winbar, gccopy, &r, 1);
+    } else
+      XCopyArea(disp, anim_pix, winbar, gccopy,
+                r.x, r.y, r.width, r.height, r.x, r.y);
+  }
+
+  stats.frames++;
+  stats.x_requests += NextRequest(disp) - seq;
+  hist_add(&stats.frame, cpu_us() - t0);
+}
+
+/*
+ * config file
+ */
+
+struct setting settings[S_MAX] = {
+  [S_ONIN]      = { "on_in", &ONIN_C, NULL },
+  [S_ONOUT]     = { "on_out", &ONOUT_C, NULL },
+  [S_OFFIN]     = { "off_in", &OFFIN_C, NULL },
+  [S_OFFOUT]    = { "off_out", &OFFOUT_C, NULL },
+  [S_CHECKER]   = { "checker", &EXTERNAL_CHECK, NULL },
+  [S_THICKNESS] = { "thickness", NULL, &bi_thick },
+  [S_INTERVAL]  = { "interval", NULL, &bi_interval },
+  [S_POSITION]  = { "position", NULL, &bi_direction },
+  [S_ONTOP]     = { "always_on_top", NULL, &alwaysontop },
+};
+
+void config_default_path(void)
+{
+  char *base = getenv("XDG_CONFIG_HOME"), *home = getenv("HOME");
+
+  if (base && *base)
+    snprintf(config_path, sizeof(config_path), "%s/xbattbar/config", base);
+  else if (home)
+    snprintf(config_path, sizeof(config_path),
+             "%s/.config/xbattbar/config", home);
+}
+
+/* set one setting from the file, False if the value is not usable */
+static int config_set(struct setting *st, char *val)
+{
+  int n;
+
+  if (!*val)
+    return False;
+  if (st->str) {
+    if (strlen(val) >= sizeof(st->value))
+      return False;
+    strcpy(st->value, val);
+    *st->str = st->value;
+    return True;
+  }
+  if (st->num == &bi_direction) {
+    *st->num = parse_direction(val);
+    return True;
+  }
+  if (st->num == &alwaysontop) {
+    *st->num = strcasecmp(val, "yes") == 0 || strcasecmp(val, "true") == 0
+      || strcasecmp(val, "on") == 0 || strcmp(val, "1") == 0;
+    return True;
+  }
+  if ((n = atoi(val)) <= 0)
+    return False;
+  *st->num = n;
+  return True;
+}
+
+/*
+ * apply_config:
+ * bring the running bar in line with changed settings, touching only
+ * the colors and the window geometry which actually changed
+ */
+static void apply_config(char old_c[][PATH_MAX], int old_thick, int old_dir,
+                         int old_interval, int old_ontop)
+{
+  static unsigned long *pixel_of[] = { &onin, &onout, &offin, &offout };
+  unsigned long pixel;
+  int i, repaint = False;
+  struct meter *m;
+
+  if (bi_interval != old_interval && !replay_fp)
+    next_sample = now_ms() + bi_interval * 1000LL;
+  if (headless)
+    return;
+
+  for (i = S_ONIN; i <= S_OFFOUT; i++) {
+    if (strcmp(old_c[i], *settings[i].str) == 0)
+      continue;
+    if (!AllocColor(*settings[i].str, &pixel)) {
+      fprintf(stderr, "xbattbar: can't allocate color %s\n",
+              *settings[i].str);
+      continue;
+    }
+    XFreeColors(disp, DefaultColormap(disp, 0), pixel_of[i], 1, 0);
+    *pixel_of[i] = pixel;
+    repaint = True;
+  }
+
+  if (bi_thick != old_thick || bi_direction != old_dir) {
+    bar_geometry(bi_direction, 0, bi_thick,
+                 &bi_x, &bi_y, &bi_width, &bi_height);
+    XMoveResizeWindow(disp, winbar, bi_x, bi_y, bi_width, bi_height);
+    if (spark_mode != SPARK_NONE)
+      init_sparkline();
+    if (anim_pix)
+      init_animation();
+    place_meters();
+    for (m = meters; m < meters + nmeters; m++)
+      draw_meter(m);
+    repaint = True;
+  }
+
+  if (alwaysontop && !old_ontop)
+    XRaiseWindow(disp, winbar);
+  if (repaint)
+    redraw();
+}
+
+/*
+ * load_config:
+ * read the config file (a missing file just means defaults) and apply
+ * what has changed since the last time
+ */
+void load_config(void)
+{
+  static int loaded = False;
+  char old_c[S_OFFOUT + 1][PATH_MAX];
+  int old_thick = bi_thick, old_dir = bi_direction;
+  int old_interval = bi_interval, old_ontop = alwaysontop;
+  char line[PATH_MAX + 64], *key, *val, *end;
+  struct setting *st;
+  int i, lineno = 0;
+  FILE *fp;
+
+  for (i = 0; i < S_MAX; i++) {
+    st = &settings[i];
+    if (!loaded) {
+      /* what we have before the first load are the defaults */
+      if (st->str)
+        st->def_str = *st->str;
+      else
+        st->def_num = *st->num;
+    }
+    if (i <= S_OFFOUT)
+      snprintf(old_c[i], sizeof(old_c[i]), "%s", *st->str);
+    if (st->from_cli)
+      continue;
+    if (st->str)
+      *st->str = st->def_str;
+    else
+      *st->num = st->def_num;
+  }
+
+  if ((fp = fopen(config_path, "r")) != NULL) {
+    while (fgets(line, sizeof(line), fp)) {
+      lineno++;
+      key = line + strspn(line, " \t\r\n");
+      if (!*key || *key == '#')
+        continue;
+      if ((val = strchr(key, '=')) == NULL) {
+        fprintf(stderr, "xbattbar: %s:%d: missing '='\n",
+                config_path, lineno);
+        continue;
+      }
+      for (end = val; end > key && strchr(" \t=", end[-1]); end--)
+        ;
+      *end = '\0';
+      val += 1 + strspn(val + 1, " \t");
+      /* a comment follows a blank; a value may start "#rrggbb" */
+      for (end = val; (end = strchr(end, '#')) != NULL; end++)
+        if (end == val ? strchr(" \t\r\n", end[1]) != NULL
+                       : strchr(" \t", end[-1]) != NULL) {
+          *end = '\0';
+          break;
+        }
+      for (end = val + strlen(val); end > val && strchr(" \t\r\n", end[-1]);
+           end--)
+        ;
+      *end = '\0';
+
+      for (st = settings; st < settings + S_MAX; st++)
+        if (strcmp(st->name, key) == 0)
+          break;
+      if (st == settings + S_MAX)
+        fprintf(stderr, "xbattbar: %s:%d: unknown setting %s\n",
+                config_path, lineno, key);
+      else if (!st->from_cli && !config_set(st, val))
+        fprintf(stderr, "xbattbar: %s:%d: bad value for %s\n",
+                config_path, lineno, key);
+    }
+    fclose(fp);
+  }
+
+  if (spark_mode != SPARK_NONE && bi_thick < SparkMinThick) {
+    fprintf(stderr, "xbattbar: sparkline needs a thickness of at least %d\n",
+            SparkMinThick);
+    bi_thick = loaded ? old_thick : settings[S_THICKNESS].def_num;
+  }
+
+  if (loaded) {
+    stats.reloads++;
+    apply_config(old_c, old_thick, old_dir, old_interval, old_ontop);
+  }
+  loaded = True;
+}
+
+/*
+ * the config file's directory is watched rather than the file, so that
+ * editors which replace the file by renaming are noticed too
+ */
+void init_config_watch(void)
+{
+#ifdef __linux__
+  char dir[PATH_MAX], *slash;
+  int fd;
+
+  strcpy(dir, config_path);
+  if ((slash = strrchr(dir, '/')) == NULL)
+    strcpy(dir, ".");
+  else
+    slash[slash == dir] = '\0';
+
+  if ((fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1)
+    return;
+  if (inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO |
+                        IN_MOVED_FROM | IN_DELETE) == -1) {
+    close(fd);
+    return;
+  }
+  pfd[PFD_CONFIG].fd = fd;
+#endif
+}
+
+/*
+ * read_config_watch:
+ * drain the inotify queue, return True if the config file was touched
+ */
+int read_config_watch(void)
+{
+  int found = False;
+#ifdef __linux__
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  struct inotify_event *ev;
+  char *p, *base;
+  int n;
+
+  base = strrchr(config_path, '/');
+  base = base ? base + 1 : config_path;
+  while ((n = read(pfd[PFD_CONFIG].fd, buf, sizeof(buf))) > 0)
+    for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+      ev = (struct inotify_event *)p;
+      if (ev->len && strcmp(ev->name, base) == 0)
+        found = True;
+    }
+#endif
+  return found;
+}
+
+/*
+ * critical battery actions
+ */
+
+void add_action(char *spec)
+{
+  char *colon = strchr(spec, ':');
+
+  if (nactions == MaxActions) {
+    fprintf(stderr, "xbattbar: too many actions (max %d)\n", MaxActions);
+    _exit(1);
+  }
+  if (colon == NULL || colon == spec || colon[1] == '\0') {
+    fprintf(stderr, "xbattbar: action must be level:command\n");
+    _exit(1);
+  }
+  actions[nactions].level = atoi(spec);
+  actions[nactions].command = colon + 1;
+  actions[nactions].armed = True;
+  actions[nactions].count = 0;
+  nactions++;
+}
+
+/*
+ * check_actions:
+ * called on every successful sample, including the ones triggered by
+ * uevents, so thresholds are noticed without extra polling
+ */
+void check_actions(void)
+{
+  struct action *a;
+
+  for (a = actions; a < actions + nactions; a++) {
+    if (!a->armed) {
+      if (ac_line && battery_level >= a->level + action_hysteresis)
+        a->armed = True;
+      continue;
+    }
+    if (ac_line || battery_level > a->level) {
+      a->count = 0;
+      continue;
+    }
+    if (++a->count < action_debounce)
+      continue;
+    a->armed = False;
+    a->count = 0;
+    run_action(a);
+  }
+}
+
+/*
+ * run_action:
+ * start the command detached (double fork) so that neither rendering
+ * nor sampling waits for it and no zombie is left behind
+ */
+void run_action(struct action *a)
+{
+  char level[16], threshold[16];
+  int pid, status;
+
+  stats.actions++;
+  snprintf(level, sizeof(level), "%d", battery_level);
+  snprintf(threshold, sizeof(threshold), "%d", a->level);
+
+  if ((pid = fork()) == -1) {
+    perror("xbattbar: fork");
+    return;
+  }
+  if (pid == 0) {
+    if (fork() == 0) {
+      setsid();
+      setenv("XBATTBAR_LEVEL", level, 1);
+      setenv("XBATTBAR_THRESHOLD", threshold, 1);
+      execl("/bin/sh", "sh", "-c", a->command, (char *)NULL);
+      fprintf(stderr, "xbattbar: exec /bin/sh: %s\n", strerror(errno));
+      _exit(127);
+    }
+    _exit(0);
+  }
+  waitpid(pid, &status, 0);
+}
+
+/*
+ * kernel uevents: the power_supply class announces changes of
+ * its devices (plug, unplug, charge state) on a netlink socket
+ */
+
+void init_uevent(void)
+{
+#ifdef __linux__
+  struct sockaddr_nl snl;
+  int fd;
+
+  memset(&snl, 0, sizeof(snl));
+  snl.nl_family = AF_NETLINK;
+  snl.nl_groups = 1;
+
+  fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+              NETLINK_KOBJECT_UEVENT);
+  if (fd == -1)
+    return;
+  if (bind(fd, (struct sockaddr *)&snl, sizeof(snl)) == -1) {
+    close(fd);
+    return;
+  }
+  pfd[PFD_UEVENT].fd = fd;
+#endif
+}
+
+/*
+ * read_uevent:
+ * drain the socket, return True if any message was about power_supply
+ */
+int read_uevent(void)
+{
+  char buf[4096], *p;
+  int n, found = False;
+
+  while ((n = recv(pfd[PFD_UEVENT].fd, buf, sizeof(buf) - 1, 0)) > 0) {
+    buf[n] = '\0';
+    /* "ACTION@DEVPATH\0KEY=VALUE\0..." */
+    for (p = buf; p < buf + n; p += strlen(p) + 1)
+      if (strcmp(p, "SUBSYSTEM=power_supply") == 0) {
+        stats.uevents++;
+        found = True;
+        break;
+      }
+  }
+  return found;
+}